@@ -0,0 +1,83 @@
+#ifndef ACTIVITY_H_
+#define ACTIVITY_H_
+
+/*
+ * Activity Analytics
+ * Window statistics and aggregation rules shared by the mote and the host replay tool
+ * Kept free of Contiki dependencies so both build the exact same arithmetic
+ */
+
+// Number of readings folded into one value at medium activity (4-into-1)
+#define MEDIUM_ACTIVITY_BLOCK 4
+
+// Activity level definition
+enum ActivityLevel {
+    LOW_ACTIVITY,
+    MEDIUM_ACTIVITY,
+    HIGH_ACTIVITY
+};
+
+// Calculates square root
+static inline float sRoot(float number) {
+    float difference = 0.0;
+    float error = 0.001;  // error tolerance
+    float x = 10.0;       // initial guess
+    int   i;
+    for (i=0; i<50; i++) {
+        x = 0.5 * (x + number/x);
+        difference = x*x - number;
+        if (difference<0) difference = -difference;
+        if (difference<error) break; // the difference is deemed small enough
+    }
+    return x;
+}
+
+// Calculates the mean of a window, the single value reported at low activity
+static inline float windowMean(const float *el, unsigned int n) {
+    float sum = 0.0;
+    unsigned int i;
+    for (i = 0; i < n; ++i) {
+        sum += el[i];
+    }
+    return sum / (float)n;
+}
+
+// Calculates the mean of one medium activity block
+static inline float blockMean(const float *el) {
+    return (el[0] + el[1] + el[2] + el[3]) / 4.0;
+}
+
+// Calculates standard deviation of the population
+static inline float windowStandardDeviation(const float *el, unsigned int n) {
+    float sum = 0.0, mean, squareRootableValue, sumOfSquares = 0.0;
+    unsigned int i;
+    for (i = 0; i < n; ++i) {
+        sum += el[i];
+    }
+    mean = sum / (float)n;
+    for (i = 0; i < n; ++i) {
+        sumOfSquares += (el[i] - mean) * (el[i] - mean);
+    }
+    squareRootableValue = sumOfSquares / n;
+    return sRoot(squareRootableValue);
+}
+
+// Maps the standard deviation of a window onto its activity level
+static inline enum ActivityLevel classifyActivity(float stdDev, float lowThreshold, float highThreshold) {
+    if (stdDev <= lowThreshold)
+        return LOW_ACTIVITY;
+    if (stdDev > highThreshold)
+        return HIGH_ACTIVITY;
+    return MEDIUM_ACTIVITY;
+}
+
+// Number of values reported for a window of n readings at the given activity level
+static inline unsigned int aggregatedLength(enum ActivityLevel level, unsigned int n) {
+    if (level == LOW_ACTIVITY)
+        return 1;
+    if (level == MEDIUM_ACTIVITY)
+        return n / MEDIUM_ACTIVITY_BLOCK;
+    return n;
+}
+
+#endif /* ACTIVITY_H_ */
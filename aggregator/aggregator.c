@@ -7,6 +7,18 @@
 #include "dev/light-sensor.h"
 #include "dev/sht11-sensor.h"
 
+#include "activity.h"
+
+// Hot-path profiling is compiled out unless built with PROFILE=1
+#ifndef PROFILE_CONF_ENABLED
+#define PROFILE_CONF_ENABLED 0
+#endif
+
+#if PROFILE_CONF_ENABLED
+#include "sys/rtimer.h"
+#include "sys/energest.h"
+#endif
+
 /*
  * String formatting helper functions
  * Extracting Integer and Flat parts
@@ -26,21 +38,6 @@ unsigned int extractFraction(float f) {
     return (abs(fractionPart));
 }
 
-// Calculates square root
-float sRoot(float number) {
-    float difference = 0.0;
-    float error = 0.001;  // error tolerance
-    float x = 10.0;       // initial guess
-    int   i;
-    for (i=0; i<50; i++) {
-        x = 0.5 * (x + number/x);
-        difference = x*x - number;
-        if (difference<0) difference = -difference;
-        if (difference<error) break; // the difference is deemed small enough
-    }
-    return x;
-}
-
 /*
  * FIFO Queue Implementation
  * All required helper methods included
@@ -52,6 +49,7 @@ struct FIFOQueue {
     int size;
     int last;
     float el[12];
+    clock_time_t ts[12];  // clock ticks at which each reading was taken
 };
 
 // Light data access object definition
@@ -59,17 +57,19 @@ struct FIFOQueue lightDao = {
         12,
         0,
         11,
+        { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 },
         { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }
 };
 
 // Enqueues light measurements and automatically dequeues the first reading
-void queueLightMeasurement(float item) {
+void queueLightMeasurement(float item, clock_time_t ts) {
     int x;
     for (x=(lightDao.last - 1); x >= 0; x--) {
         lightDao.el[x + 1] = lightDao.el[x];
+        lightDao.ts[x + 1] = lightDao.ts[x];
     }
     lightDao.el[0] = item;
-    printf("new reading = %ld.%03u\n", extractInteger(item), extractFraction(item));
+    lightDao.ts[0] = ts;
     if (lightDao.size < (lightDao.capacity - 1))
         lightDao.size = lightDao.size + 1;
 }
@@ -87,14 +87,31 @@ void printElements(struct FIFOQueue dao) {
     printf("]\n");
 }
 
+// Aggregates the window according to its activity level into results, returns the number of values
+unsigned int aggregateReadings(struct FIFOQueue dao, enum ActivityLevel level, float *results) {
+    unsigned int i, count = aggregatedLength(level, dao.capacity);
+    if (level == LOW_ACTIVITY) {
+        results[0] = windowMean(dao.el, dao.capacity);
+    } else if (level == MEDIUM_ACTIVITY) {
+        for (i = 0; i < count; i++) {
+            results[i] = blockMean(&dao.el[i * MEDIUM_ACTIVITY_BLOCK]);
+        }
+    } else {
+        for (i = 0; i < count; i++) {
+            results[i] = dao.el[i];
+        }
+    }
+    return count;
+}
+
 // Prints log on high-activity level
-void printHighActivityResults(struct FIFOQueue dao) {
+void printHighActivityResults(float *results, unsigned int count) {
     int i;
     printf("Aggregation = None [ High Activity ]\n");
     printf("X = [");
-    for (i=0; i <= dao.last; i++){
-        printf("%ld.%03u", extractInteger(dao.el[i]), extractFraction(dao.el[i]));
-        if (i != dao.last) {
+    for (i=0; i < count; i++){
+        printf("%ld.%03u", extractInteger(results[i]), extractFraction(results[i]));
+        if (i != count - 1) {
             printf(", ");
         }
     }
@@ -102,18 +119,13 @@ void printHighActivityResults(struct FIFOQueue dao) {
 }
 
 // Prints log on medium-activity level
-void printMediumActivityResults(struct FIFOQueue dao) {
-    float results[3];
-    results[0] = (dao.el[0] + dao.el[1] + dao.el[2] + dao.el[3]) / 4.0;
-    results[1] = (dao.el[4] + dao.el[5] + dao.el[6] + dao.el[7]) / 4.0;
-    results[2] = (dao.el[8] + dao.el[9] + dao.el[10] + dao.el[11]) / 4.0;
-
+void printMediumActivityResults(float *results, unsigned int count) {
     int i;
     printf("Aggregation = 4-into-1 [ Medium Activity ]\n");
     printf("X = [");
-    for (i=0; i < 3; i++){
+    for (i=0; i < count; i++){
         printf("%ld.%03u", extractInteger(results[i]), extractFraction(results[i]));
-        if (i != 2) {
+        if (i != count - 1) {
             printf(", ");
         }
     }
@@ -121,32 +133,210 @@ void printMediumActivityResults(struct FIFOQueue dao) {
 }
 
 // Prints log on low-activity level
-void printLowActivityResults(struct FIFOQueue dao) {
-    int i;
-    float sum = 0.0;
-    for (i = 0; i < dao.capacity; ++i) {
-        sum += dao.el[i];
-    }
-    float result = sum / (float)dao.capacity;
+void printLowActivityResults(float *results) {
     printf("Aggregation = 12-into-1 [ Low Activity ]\n");
-    printf("X = [ %ld.%03u ]\n\n", extractInteger(result), extractFraction(result));
+    printf("X = [ %ld.%03u ]\n\n", extractInteger(results[0]), extractFraction(results[0]));
 }
 
 // Calculates standard deviation of the population
 float calculateStandardDeviation(struct FIFOQueue dao) {
-    float sum = 0.0, mean, squareRootableValue, sumOfSquares = 0.0;
+    return windowStandardDeviation(dao.el, dao.capacity);
+}
+
+/*
+ * Sample Ring Buffer
+ * Lock-free single-producer/single-consumer hand-off from the sampler to analytics
+ */
+
+// Ring capacity, must be a power of two
+#define SAMPLE_RING_SIZE 16
+// Maximum number of samples the analytics process drains before yielding
+#define ANALYTICS_BATCH_SIZE 4
+
+// Raw sample structure definition
+struct Sample {
+    clock_time_t lightTs;
+    float light;
+};
+
+// Ring buffer structure definition
+// head is only written by the sampler and tail only by analytics, so no locking is needed
+struct SampleRing {
+    volatile unsigned int head;
+    volatile unsigned int tail;
+    unsigned int overruns;
+    struct Sample el[SAMPLE_RING_SIZE];
+};
+
+// Sampler to analytics hand-off buffer
+struct SampleRing sampleRing;
+
+// Pushes a sample, dropping it when analytics has fallen a full ring behind
+int pushSample(struct Sample *sample) {
+    unsigned int head = sampleRing.head;
+    if ((unsigned int)(head - sampleRing.tail) >= SAMPLE_RING_SIZE) {
+        sampleRing.overruns = sampleRing.overruns + 1;
+        return 0;
+    }
+    sampleRing.el[head & (SAMPLE_RING_SIZE - 1)] = *sample;
+    // Publish only once the slot has been written
+    sampleRing.head = head + 1;
+    return 1;
+}
+
+// Pops the oldest sample, returns 0 when the ring is empty
+int popSample(struct Sample *sample) {
+    unsigned int tail = sampleRing.tail;
+    if (tail == sampleRing.head)
+        return 0;
+    *sample = sampleRing.el[tail & (SAMPLE_RING_SIZE - 1)];
+    sampleRing.tail = tail + 1;
+    return 1;
+}
+
+/*
+ * Sampling Timing Instrumentation
+ * Jitter and missed deadline tracking for the sampling etimer
+ */
+
+// Timing statistics structure definition
+struct TickTiming {
+    unsigned long ticks;
+    unsigned int missedDeadlines;
+    clock_time_t jitter;     // worst jitter since the last report, so catch-up ticks are never hidden
+    clock_time_t maxJitter;
+};
+
+// Sampling timer statistics
+struct TickTiming tickTiming = { 0, 0, 0, 0 };
+
+// Records how late the etimer fired relative to its deadline
+void recordTickTiming(clock_time_t deadline, clock_time_t now, clock_time_t interval) {
+    clock_time_t jitter = (clock_time_t)(now - deadline);
+    tickTiming.ticks = tickTiming.ticks + 1;
+    if (jitter > tickTiming.jitter)
+        tickTiming.jitter = jitter;
+    if (jitter > tickTiming.maxJitter)
+        tickTiming.maxJitter = jitter;
+    // etimer_reset() keeps the phase, so every deadline is still delivered, late ones in a
+    // catch-up burst; each tick counts once, as missed, when it is served after the next one fell due
+    if (jitter >= interval)
+        tickTiming.missedDeadlines = tickTiming.missedDeadlines + 1;
+}
+
+// Prints sampling timing statistics and starts a new jitter reporting period
+void printTickTiming(void) {
+    printf("Jitter = %u ticks, Max Jitter = %u ticks, Missed Deadlines = %u, Overruns = %u\n",
+           (unsigned int) tickTiming.jitter, (unsigned int) tickTiming.maxJitter, tickTiming.missedDeadlines,
+           sampleRing.overruns);
+    tickTiming.jitter = 0;
+}
+
+/*
+ * Hot-path Profiling
+ * Per-stage RTIMER_NOW() timings folded into min/avg/max, reported with energest CPU/LPM time
+ */
+#if PROFILE_CONF_ENABLED
+
+// Number of analytics batches between two profile reports
+#define PROFILE_REPORT_INTERVAL 20
+
+// Profiled stages of the sampling loop
+enum ProfileStage {
+    PROFILE_READ,
+    PROFILE_ENQUEUE,
+    PROFILE_STATS,
+    PROFILE_AGGREGATE,
+    PROFILE_OUTPUT,
+    PROFILE_STAGES
+};
+
+// Per-stage timing structure definition, in rtimer ticks
+struct StageProfile {
+    rtimer_clock_t current;  // accumulated over the running analytics batch, unused for reads
+    rtimer_clock_t min;
+    rtimer_clock_t max;
+    unsigned long total;
+};
+
+struct StageProfile stageProfiles[PROFILE_STAGES];
+unsigned int profiledTicks = 0;
+unsigned int profiledReads = 0;
+unsigned long lastCpuTime = 0;
+unsigned long lastLpmTime = 0;
+rtimer_clock_t profileStart;
+
+// Adds the time spent in a stage to the running analytics batch
+void recordStageTime(enum ProfileStage stage, rtimer_clock_t elapsed) {
+    stageProfiles[stage].current = stageProfiles[stage].current + elapsed;
+}
+
+// Folds one sensor read straight into min/avg/max, reads happen in the sampler and are timed each on their own
+void recordReadTime(rtimer_clock_t elapsed) {
+    struct StageProfile *read = &stageProfiles[PROFILE_READ];
+    if (profiledReads == 0 || elapsed < read->min)
+        read->min = elapsed;
+    if (elapsed > read->max)
+        read->max = elapsed;
+    read->total = read->total + elapsed;
+    profiledReads = profiledReads + 1;
+}
+
+// Prints the compact profile record and starts a new reporting period
+void printProfile(void) {
+    static const char *names[PROFILE_STAGES] = { "read", "enq", "stats", "aggr", "out" };
+    unsigned long cpu, lpm;
     int i;
-    for (i = 0; i < dao.capacity; ++i) {
-        sum += dao.el[i];
+    energest_flush();
+    cpu = energest_type_time(ENERGEST_TYPE_CPU);
+    lpm = energest_type_time(ENERGEST_TYPE_LPM);
+    printf("P n=%u r=%u", profiledTicks, profiledReads);
+    for (i = 0; i < PROFILE_STAGES; i++) {
+        unsigned int count = i == PROFILE_READ ? profiledReads : profiledTicks;
+        printf(" %s=%u/%lu/%u", names[i], (unsigned int) stageProfiles[i].min,
+               count ? stageProfiles[i].total / count : 0, (unsigned int) stageProfiles[i].max);
+        stageProfiles[i].min = 0;
+        stageProfiles[i].max = 0;
+        stageProfiles[i].total = 0;
     }
-    mean = sum / (float)dao.capacity;
-    for (i = 0; i < dao.capacity; ++i) {
-        sumOfSquares += (dao.el[i] - mean) * (dao.el[i] - mean);
+    printf(" cpu=%lu lpm=%lu\n", cpu - lastCpuTime, lpm - lastLpmTime);
+    lastCpuTime = cpu;
+    lastLpmTime = lpm;
+    profiledTicks = 0;
+    profiledReads = 0;
+}
+
+// Folds the running analytics batch into the per-stage min/avg/max of the analytics stages
+void endProfileTick(void) {
+    int i;
+    for (i = PROFILE_ENQUEUE; i < PROFILE_STAGES; i++) {
+        rtimer_clock_t t = stageProfiles[i].current;
+        if (profiledTicks == 0 || t < stageProfiles[i].min)
+            stageProfiles[i].min = t;
+        if (t > stageProfiles[i].max)
+            stageProfiles[i].max = t;
+        stageProfiles[i].total = stageProfiles[i].total + t;
+        stageProfiles[i].current = 0;
     }
-    squareRootableValue = sumOfSquares / dao.capacity;
-    return sRoot(squareRootableValue);
+    profiledTicks = profiledTicks + 1;
+    if (profiledTicks >= PROFILE_REPORT_INTERVAL)
+        printProfile();
 }
 
+#define PROFILE_START()      profileStart = RTIMER_NOW()
+#define PROFILE_STOP(stage)  recordStageTime((stage), (rtimer_clock_t)(RTIMER_NOW() - profileStart))
+#define PROFILE_STOP_READ()  recordReadTime((rtimer_clock_t)(RTIMER_NOW() - profileStart))
+#define PROFILE_END_TICK()   endProfileTick()
+
+#else
+
+#define PROFILE_START()
+#define PROFILE_STOP(stage)
+#define PROFILE_STOP_READ()
+#define PROFILE_END_TICK()
+
+#endif /* PROFILE_CONF_ENABLED */
+
 /*
  * Implementation of Sensors
  * Relevant conversion functions for skymote
@@ -163,40 +353,130 @@ float getLight(void) {
 /* ===========================================================
                            Execution
  ============================================================= */
+PROCESS(sampler, "Sampler");
 PROCESS(aggregator, "Aggregator");
-AUTOSTART_PROCESSES(&aggregator);
-PROCESS_THREAD(aggregator, ev, data) {
+AUTOSTART_PROCESSES(&sampler, &aggregator);
+
+// Posted to the analytics process when samples are waiting in the ring
+process_event_t samplesReadyEvent;
+// Set while analytics owns the ring backlog, so the event queue is never flooded
+unsigned char samplesReadyPending = 0;
+
+// Sampling only reads the sensor and hands the reading over, so its cadence is not held up by analytics
+PROCESS_THREAD(sampler, ev, data) {
     static struct etimer timer;
+    static clock_time_t interval;
+    static struct Sample sample;
     PROCESS_BEGIN();
 
-    etimer_set(&timer, CLOCK_CONF_SECOND / MEASUREMENTS_PER_SECOND);
+    samplesReadyEvent = process_alloc_event();
+    interval = CLOCK_CONF_SECOND / MEASUREMENTS_PER_SECOND;
+    etimer_set(&timer, interval);
 
     SENSORS_ACTIVATE(light_sensor);
 
+    while(1) {
+        PROCESS_WAIT_EVENT_UNTIL(ev == PROCESS_EVENT_TIMER);
+
+        sample.lightTs = clock_time();
+        recordTickTiming(etimer_expiration_time(&timer), sample.lightTs, interval);
+        etimer_reset(&timer);
+
+        PROFILE_START();
+        sample.light = getLight();
+        PROFILE_STOP_READ();
+        pushSample(&sample);
+        // Wake analytics whenever the ring holds samples, even if this one was dropped, so a full ring
+        // never stalls; the flag is only taken when the post was queued, otherwise the next tick retries it
+        if (!samplesReadyPending && sampleRing.head != sampleRing.tail
+                && process_post(&aggregator, samplesReadyEvent, NULL) == PROCESS_ERR_OK) {
+            samplesReadyPending = 1;
+        }
+    }
+    PROCESS_END();
+}
+
+// Analytics consumes the ring in batches and runs the aggregation once per batch
+PROCESS_THREAD(aggregator, ev, data) {
+    static struct Sample sample;
+    static unsigned int batch;
+    static unsigned char windowFull;
+    static float activity;
+    static enum ActivityLevel level;
+    static float results[12];
+    static unsigned int resultCount;
+    PROCESS_BEGIN();
+
     printf("K Value = %d\n\n", 1);
 
     while(1) {
-        PROCESS_WAIT_EVENT_UNTIL(ev=PROCESS_EVENT_TIMER);
+        PROCESS_WAIT_EVENT_UNTIL(ev == samplesReadyEvent);
 
-        float light_lx = getLight();
-        float activity;
-        queueLightMeasurement(light_lx);
+        PROFILE_START();
+        for (batch = 0; batch < ANALYTICS_BATCH_SIZE && popSample(&sample); batch++) {
+            queueLightMeasurement(sample.light, sample.lightTs);
+        }
+        PROFILE_STOP(PROFILE_ENQUEUE);
         // Start aggregating the data only after 12 readings are collected
-        // K = 1; Aggregation is performed on each element being added to the FIFO queue
-        if ((lightDao.size + 1) >= lightDao.capacity) {
-            printElements(lightDao);
+        // K = 1; Aggregation is performed on each batch added to the FIFO queue, a single element unless analytics fell behind
+        windowFull = (lightDao.size + 1) >= lightDao.capacity;
+        if (windowFull) {
+            PROFILE_START();
             activity = calculateStandardDeviation(lightDao);
-            printf("StdDev = %ld.%03u\n", extractInteger(activity), extractFraction(activity));
+            PROFILE_STOP(PROFILE_STATS);
             // Perform aggregation based on activity level
-            if (activity <= LOW_ACTIVITY_THRESHOLD) {
-                printLowActivityResults(lightDao);
-            } else if (activity > HIGH_ACTIVITY_THRESHOLD) {
-                printHighActivityResults(lightDao);
-            } else {
-                printMediumActivityResults(lightDao);
+            PROFILE_START();
+            level = classifyActivity(activity, LOW_ACTIVITY_THRESHOLD, HIGH_ACTIVITY_THRESHOLD);
+            resultCount = aggregateReadings(lightDao, level, results);
+            PROFILE_STOP(PROFILE_AGGREGATE);
+        }
+
+        // All computation is done above; output follows one record at a time with a yield before
+        // each, so a sampling tick that falls due while printing waits for at most one record
+        // The batch's readings are the newest ones in the window, print them oldest first
+        while (batch > 0) {
+            batch--;
+            PROCESS_PAUSE();
+            PROFILE_START();
+            printf("new reading = %ld.%03u\n", extractInteger(lightDao.el[batch]), extractFraction(lightDao.el[batch]));
+            PROFILE_STOP(PROFILE_OUTPUT);
+        }
+        PROCESS_PAUSE();
+        PROFILE_START();
+        printTickTiming();
+        PROFILE_STOP(PROFILE_OUTPUT);
+        if (windowFull) {
+            PROCESS_PAUSE();
+            PROFILE_START();
+            printElements(lightDao);
+            PROFILE_STOP(PROFILE_OUTPUT);
+            PROCESS_PAUSE();
+            PROFILE_START();
+            printf("StdDev = %ld.%03u\n", extractInteger(activity), extractFraction(activity));
+            PROFILE_STOP(PROFILE_OUTPUT);
+            PROCESS_PAUSE();
+            PROFILE_START();
+            switch (level) {
+            case LOW_ACTIVITY:
+                printLowActivityResults(results);
+                break;
+            case HIGH_ACTIVITY:
+                printHighActivityResults(results, resultCount);
+                break;
+            default:
+                printMediumActivityResults(results, resultCount);
+                break;
             }
+            PROFILE_STOP(PROFILE_OUTPUT);
+        }
+        PROFILE_END_TICK();
+
+        // Hand the ring back to the sampler, or continue with the backlog after it had a chance to run
+        samplesReadyPending = 0;
+        if (sampleRing.head != sampleRing.tail
+                && process_post(PROCESS_CURRENT(), samplesReadyEvent, NULL) == PROCESS_ERR_OK) {
+            samplesReadyPending = 1;
         }
-        etimer_reset(&timer);
     }
     PROCESS_END();
 }
@@ -0,0 +1,577 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../aggregator/activity.h"
+
+/*
+ * Host-side Replay Engine
+ * Replays light traces through the mote aggregation rules and sweeps
+ * window size and activity thresholds over the whole fleet at once
+ */
+
+// Traces handled together by one kernel pass, sized to keep the per-tick rows in L1
+#define TILE_TRACES 256
+// Largest supported window, the mote uses 12
+#define MAX_WINDOW 64
+// Largest number of values in one parameter list
+#define MAX_SWEEP 64
+
+// Parameter grid definition
+struct Sweep {
+    unsigned int windows[MAX_SWEEP];
+    unsigned int windowCount;
+    float lows[MAX_SWEEP];
+    unsigned int lowCount;
+    float highs[MAX_SWEEP];
+    unsigned int highCount;
+    float thresholds[2 * MAX_SWEEP];  // sorted union of lows and highs, the bin edges
+    unsigned int thresholdCount;
+};
+
+// Windows whose standard deviation falls between two neighbouring thresholds
+struct Bin {
+    double windows;
+    double lowError;     // squared error had these windows been reported at low activity
+    double mediumError;  // squared error had these windows been reported at medium activity
+};
+
+// Outcome of one grid setting, summed over all traces and ticks
+struct Outcome {
+    double values;          // values reported by the aggregation
+    double rawReadings;     // new raw readings, one per K = 1 window
+    double windowReadings;  // readings the windows covered, each raw reading counted once per window
+    double squaredError;  // squared error of the aggregated against the raw readings
+    double windows[3];    // windows reported at low, medium and high activity
+};
+
+// Fleet of traces in structure-of-arrays layout: reading t of trace k is at samples[t * traceCount + k]
+struct Fleet {
+    float *samples;
+    unsigned int traceCount;
+    unsigned int length;
+};
+
+// Shared state of the worker pool
+struct Pool {
+    const struct Fleet *fleet;
+    const struct Sweep *sweep;
+    atomic_uint nextTile;
+    unsigned int tileCount;
+    struct Bin *bins;  // one row of bins per worker
+    unsigned int binCount;
+};
+
+// Arguments of one worker
+struct Worker {
+    struct Pool *pool;
+    struct Bin *bins;
+};
+
+/*
+ * Trace Loading
+ * CSV files with one trace per line, or synthetic traces for benchmarking
+ */
+
+// Appends a trace to the row-major staging buffer, growing it as needed
+static void stageTrace(float **rows, size_t *capacity, size_t *used, const float *trace, unsigned int length) {
+    if (*used + length > *capacity) {
+        *capacity = (*used + length) * 2;
+        *rows = realloc(*rows, *capacity * sizeof(float));
+        if (*rows == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memcpy(*rows + *used, trace, length * sizeof(float));
+    *used += length;
+}
+
+// Transposes row-major traces into the structure-of-arrays fleet layout
+static void transposeTraces(struct Fleet *fleet, const float *rows, unsigned int stride) {
+    unsigned int k, t;
+    fleet->samples = malloc((size_t)fleet->traceCount * fleet->length * sizeof(float));
+    if (fleet->samples == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (k = 0; k < fleet->traceCount; k++) {
+        for (t = 0; t < fleet->length; t++) {
+            fleet->samples[(size_t)t * fleet->traceCount + k] = rows[(size_t)k * stride + t];
+        }
+    }
+}
+
+// Loads traces from a CSV file, truncating every trace to the shortest one
+static int loadTraces(struct Fleet *fleet, const char *path) {
+    FILE *file = fopen(path, "r");
+    char *line = NULL;
+    size_t lineCapacity = 0;
+    float *rows = NULL, *trace = NULL;
+    size_t rowsCapacity = 0, rowsUsed = 0;
+    unsigned int traceCapacity = 0, stride = 0, shortest = 0;
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    fleet->traceCount = 0;
+    while (getline(&line, &lineCapacity, file) != -1) {
+        unsigned int length = 0;
+        char *cursor = line, *end;
+        for (;;) {
+            float value = strtof(cursor, &end);
+            if (end == cursor)
+                break;
+            if (length == traceCapacity) {
+                traceCapacity = traceCapacity ? traceCapacity * 2 : 1024;
+                trace = realloc(trace, traceCapacity * sizeof(float));
+                if (trace == NULL) {
+                    perror("realloc");
+                    exit(1);
+                }
+            }
+            trace[length++] = value;
+            cursor = end;
+            while (*cursor == ',' || *cursor == ' ' || *cursor == '\t')
+                cursor++;
+        }
+        if (length == 0)
+            continue;
+        // The first trace fixes the row stride, later ones are cut or padded to it
+        if (fleet->traceCount == 0) {
+            stride = length;
+            shortest = length;
+        }
+        if (length < shortest)
+            shortest = length;
+        while (length < stride)
+            trace[length++] = 0;
+        stageTrace(&rows, &rowsCapacity, &rowsUsed, trace, stride);
+        fleet->traceCount++;
+    }
+    fclose(file);
+    free(line);
+    free(trace);
+    if (fleet->traceCount == 0) {
+        fprintf(stderr, "%s: no traces found\n", path);
+        return -1;
+    }
+    fleet->length = shortest;
+    transposeTraces(fleet, rows, stride);
+    free(rows);
+    return 0;
+}
+
+// Generates light traces that drift between calm and bursty periods
+static void synthesiseTraces(struct Fleet *fleet, unsigned int traceCount, unsigned int length, unsigned int seed) {
+    unsigned int k, t;
+    fleet->traceCount = traceCount;
+    fleet->length = length;
+    fleet->samples = malloc((size_t)traceCount * length * sizeof(float));
+    if (fleet->samples == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    srand(seed);
+    for (k = 0; k < traceCount; k++) {
+        float level = 200.0f + (float)(rand() % 20000);
+        float spread = 0.0f;
+        for (t = 0; t < length; t++) {
+            // Activity switches every now and then between quiet and busy spells
+            if (rand() % 64 == 0)
+                spread = (float)(rand() % 8000);
+            level += ((float)rand() / RAND_MAX - 0.5f) * 0.1f * spread;
+            if (level < 0)
+                level = 0;
+            fleet->samples[(size_t)t * traceCount + k] = level + ((float)rand() / RAND_MAX - 0.5f) * spread;
+        }
+    }
+}
+
+/*
+ * Replay Kernels
+ * Every loop runs across traces, so the compiler vectorises over the fleet
+ * while each trace keeps the mote's own order of float operations
+ */
+
+// Lane-wise form of sRoot over a tile: every lane runs the same Newton steps and freezes
+// once it has converged, so results match sRoot bit for bit while the loop vectorises
+static void tileSquareRoot(float *values, unsigned int tileSize) {
+    float x[TILE_TRACES];
+    unsigned char done[TILE_TRACES];
+    unsigned int i, k, pending;
+    for (k = 0; k < tileSize; k++) {
+        x[k] = 10.0;
+        done[k] = 0;
+    }
+    for (i = 0; i < 50; i++) {
+        pending = 0;
+        for (k = 0; k < tileSize; k++) {
+            float next = 0.5 * (x[k] + values[k]/x[k]);
+            float difference = next*next - values[k];
+            if (difference<0) difference = -difference;
+            x[k] = done[k] ? x[k] : next;
+            done[k] = done[k] | (difference < 0.001f);
+            pending += !done[k];
+        }
+        if (pending == 0)
+            break;
+    }
+    for (k = 0; k < tileSize; k++)
+        values[k] = x[k];
+}
+
+// Window statistics of a tile at one tick, in the mote's newest-first window order
+static void windowStatistics(const float *samples, unsigned int traceCount, unsigned int t, unsigned int window,
+                             unsigned int tileStart, unsigned int tileSize,
+                             float *stdDev, float *lowError, float *mediumError) {
+    float sum[TILE_TRACES], mean[TILE_TRACES], sumOfSquares[TILE_TRACES];
+    unsigned int i, b, k;
+    for (k = 0; k < tileSize; k++) {
+        sum[k] = 0.0f;
+        sumOfSquares[k] = 0.0f;
+        mediumError[k] = 0.0f;
+    }
+    for (i = 0; i < window; i++) {
+        const float *row = samples + (size_t)(t - i) * traceCount + tileStart;
+        for (k = 0; k < tileSize; k++)
+            sum[k] += row[k];
+    }
+    for (k = 0; k < tileSize; k++)
+        mean[k] = sum[k] / (float)window;
+    for (i = 0; i < window; i++) {
+        const float *row = samples + (size_t)(t - i) * traceCount + tileStart;
+        for (k = 0; k < tileSize; k++)
+            sumOfSquares[k] += (row[k] - mean[k]) * (row[k] - mean[k]);
+    }
+    // Low activity reports the window mean, so its error is the window's sum of squares
+    for (k = 0; k < tileSize; k++) {
+        lowError[k] = sumOfSquares[k];
+        stdDev[k] = sumOfSquares[k] / window;
+    }
+    tileSquareRoot(stdDev, tileSize);
+    for (b = 0; b < window; b += MEDIUM_ACTIVITY_BLOCK) {
+        const float *r0 = samples + (size_t)(t - b) * traceCount + tileStart;
+        const float *r1 = r0 - traceCount, *r2 = r1 - traceCount, *r3 = r2 - traceCount;
+        for (k = 0; k < tileSize; k++) {
+            float m = (r0[k] + r1[k] + r2[k] + r3[k]) / 4.0;
+            mediumError[k] += (r0[k] - m) * (r0[k] - m) + (r1[k] - m) * (r1[k] - m)
+                            + (r2[k] - m) * (r2[k] - m) + (r3[k] - m) * (r3[k] - m);
+        }
+    }
+}
+
+// Bins a tile of windows by the number of thresholds below their standard deviation
+// A window then sits at or below threshold j exactly when its bin is at most j, so every
+// low/high setting can be evaluated afterwards from the bins alone
+static void binWindows(struct Bin *bins, const float *thresholds, unsigned int thresholdCount,
+                       const float *stdDev, const float *lowError, const float *mediumError,
+                       unsigned int tileSize) {
+    unsigned int bin[TILE_TRACES];
+    unsigned int j, k;
+    for (k = 0; k < tileSize; k++)
+        bin[k] = 0;
+    for (j = 0; j < thresholdCount; j++) {
+        float threshold = thresholds[j];
+        for (k = 0; k < tileSize; k++)
+            bin[k] += threshold < stdDev[k];
+    }
+    for (k = 0; k < tileSize; k++) {
+        struct Bin *into = &bins[bin[k]];
+        into->windows += 1;
+        into->lowError += lowError[k];
+        into->mediumError += mediumError[k];
+    }
+}
+
+// Replays one tile of traces for every window size
+static void replayTile(const struct Fleet *fleet, const struct Sweep *sweep, unsigned int tileStart,
+                       unsigned int tileSize, struct Bin *bins) {
+    float stdDev[TILE_TRACES], lowError[TILE_TRACES], mediumError[TILE_TRACES];
+    unsigned int w, t;
+    for (w = 0; w < sweep->windowCount; w++) {
+        unsigned int window = sweep->windows[w];
+        // K = 1; the mote aggregates once per reading as soon as the window is full
+        for (t = window - 1; t < fleet->length; t++) {
+            windowStatistics(fleet->samples, fleet->traceCount, t, window, tileStart, tileSize,
+                             stdDev, lowError, mediumError);
+            binWindows(bins + w * (sweep->thresholdCount + 1), sweep->thresholds, sweep->thresholdCount,
+                       stdDev, lowError, mediumError, tileSize);
+        }
+    }
+}
+
+// Evaluates one low/high setting from the bins of one window size
+static void evaluateSetting(struct Outcome *outcome, const struct Bin *bins, unsigned int binCount,
+                            unsigned int window, unsigned int lowIndex, unsigned int highIndex) {
+    unsigned int i;
+    memset(outcome, 0, sizeof(*outcome));
+    for (i = 0; i < binCount; i++) {
+        // Bin indices order exactly like the standard deviations they hold, so the mote's rule applies to them
+        enum ActivityLevel level = classifyActivity((float)i, (float)lowIndex, (float)highIndex);
+        outcome->windows[level] += bins[i].windows;
+        outcome->values += bins[i].windows * aggregatedLength(level, window);
+        outcome->rawReadings += bins[i].windows;
+        outcome->windowReadings += bins[i].windows * window;
+        if (level == LOW_ACTIVITY)
+            outcome->squaredError += bins[i].lowError;
+        else if (level == MEDIUM_ACTIVITY)
+            outcome->squaredError += bins[i].mediumError;
+    }
+}
+
+// Worker loop, takes tiles off the shared counter until the fleet is exhausted
+static void *replayWorker(void *argument) {
+    struct Worker *worker = argument;
+    struct Pool *pool = worker->pool;
+    for (;;) {
+        unsigned int tile = atomic_fetch_add(&pool->nextTile, 1);
+        unsigned int tileStart, tileSize;
+        if (tile >= pool->tileCount)
+            break;
+        tileStart = tile * TILE_TRACES;
+        tileSize = pool->fleet->traceCount - tileStart;
+        if (tileSize > TILE_TRACES)
+            tileSize = TILE_TRACES;
+        replayTile(pool->fleet, pool->sweep, tileStart, tileSize, worker->bins);
+    }
+    return NULL;
+}
+
+// Checks the vectorised kernel against the mote's own window statistics on a few windows
+static int verifyKernel(const struct Fleet *fleet, unsigned int window) {
+    float stdDev[TILE_TRACES], lowError[TILE_TRACES], mediumError[TILE_TRACES], el[MAX_WINDOW];
+    unsigned int tileSize = fleet->traceCount < TILE_TRACES ? fleet->traceCount : TILE_TRACES;
+    unsigned int t, i, k;
+    for (t = window - 1; t < fleet->length && t < window + 16; t++) {
+        windowStatistics(fleet->samples, fleet->traceCount, t, window, 0, tileSize, stdDev, lowError, mediumError);
+        for (k = 0; k < tileSize; k++) {
+            for (i = 0; i < window; i++)
+                el[i] = fleet->samples[(size_t)(t - i) * fleet->traceCount + k];
+            if (windowStandardDeviation(el, window) != stdDev[k]) {
+                fprintf(stderr, "kernel mismatch: trace %u tick %u window %u\n", k, t, window);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Command Line
+ */
+
+// Parses "a,b,c" or "start:stop:step" into a list of values, returns 0 on any non-finite value
+// or when the list holds more than MAX_SWEEP values, so a grid is never silently cut short
+static unsigned int parseList(const char *text, float *values) {
+    float start, stop, step;
+    unsigned int count = 0;
+    if (sscanf(text, "%f:%f:%f", &start, &stop, &step) == 3) {
+        if (!isfinite(start) || !isfinite(stop) || !isfinite(step) || step <= 0)
+            return 0;
+        for (; start <= stop + step / 2; start += step) {
+            if (count == MAX_SWEEP)
+                return 0;
+            values[count++] = start;
+        }
+        return count;
+    }
+    while (*text) {
+        char *end;
+        float value = strtof(text, &end);
+        if (end == text)
+            break;
+        if (!isfinite(value) || count == MAX_SWEEP)
+            return 0;
+        values[count++] = value;
+        text = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+// Parses a strictly positive count, returns 0 on anything else
+static unsigned int parseCount(const char *text) {
+    char *end;
+    long value = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || value <= 0 || value > 0x7fffffffL)
+        return 0;
+    return (unsigned int) value;
+}
+
+// Compares two floats for qsort
+static int compareFloats(const void *a, const void *b) {
+    float x = *(const float *)a, y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+// Builds the sorted, de-duplicated bin edges from the low and high thresholds
+static void collectThresholds(struct Sweep *sweep) {
+    unsigned int i, count = 0;
+    memcpy(sweep->thresholds, sweep->lows, sweep->lowCount * sizeof(float));
+    memcpy(sweep->thresholds + sweep->lowCount, sweep->highs, sweep->highCount * sizeof(float));
+    qsort(sweep->thresholds, sweep->lowCount + sweep->highCount, sizeof(float), compareFloats);
+    for (i = 0; i < sweep->lowCount + sweep->highCount; i++) {
+        if (count == 0 || sweep->thresholds[count - 1] != sweep->thresholds[i])
+            sweep->thresholds[count++] = sweep->thresholds[i];
+    }
+    sweep->thresholdCount = count;
+}
+
+// Position of a threshold among the bin edges
+static unsigned int thresholdIndex(const struct Sweep *sweep, float threshold) {
+    unsigned int i = 0;
+    while (i + 1 < sweep->thresholdCount && sweep->thresholds[i] != threshold)
+        i++;
+    return i;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-f traces.csv | -n traces -L length -S seed] [-j threads]\n"
+            "          [-w windows] [-l low thresholds] [-H high thresholds]\n"
+            "lists are \"a,b,c\" or \"start:stop:step\" of up to %d values; windows must be multiples of %d up to %d\n",
+            name, MAX_SWEEP, MEDIUM_ACTIVITY_BLOCK, MAX_WINDOW);
+}
+
+int main(int argc, char **argv) {
+    struct Sweep sweep;
+    struct Fleet fleet;
+    struct Pool pool;
+    struct Worker *workers;
+    pthread_t *threads;
+    struct timespec started, finished;
+    float windows[MAX_SWEEP] = { 12 };
+    const char *path = NULL;
+    unsigned int traceCount = 1000, length = 3600, seed = 1;
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int threadCount = processors > 0 ? (unsigned int) processors : 0;  // 0 asks for an explicit -j
+    unsigned int i, j, w, l, h;
+    int option;
+
+    sweep.windowCount = 1;
+    sweep.lowCount = parseList("250:2000:250", sweep.lows);
+    sweep.highCount = parseList("1000:6000:500", sweep.highs);
+    while ((option = getopt(argc, argv, "f:n:L:S:j:w:l:H:")) != -1) {
+        switch (option) {
+        case 'f': path = optarg; break;
+        case 'n': traceCount = parseCount(optarg); break;
+        case 'L': length = parseCount(optarg); break;
+        case 'S': seed = (unsigned int) atoi(optarg); break;
+        case 'j': threadCount = parseCount(optarg); break;
+        case 'w': sweep.windowCount = parseList(optarg, windows); break;
+        case 'l': sweep.lowCount = parseList(optarg, sweep.lows); break;
+        case 'H': sweep.highCount = parseList(optarg, sweep.highs); break;
+        default: usage(argv[0]); return 2;
+        }
+    }
+    for (w = 0; w < sweep.windowCount; w++) {
+        // Windows are whole readings, fractional sizes or steps are refused rather than truncated
+        if (windows[w] < 1 || windows[w] > MAX_WINDOW || windows[w] != floorf(windows[w])) {
+            usage(argv[0]);
+            return 2;
+        }
+        sweep.windows[w] = (unsigned int) windows[w];
+        if (sweep.windows[w] % MEDIUM_ACTIVITY_BLOCK) {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (sweep.windowCount == 0 || sweep.lowCount == 0 || sweep.highCount == 0 || threadCount == 0
+        || traceCount == 0 || length == 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (path != NULL) {
+        if (loadTraces(&fleet, path) != 0)
+            return 1;
+    } else {
+        synthesiseTraces(&fleet, traceCount, length, seed);
+    }
+    if (fleet.traceCount == 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    for (w = 0; w < sweep.windowCount; w++) {
+        if (sweep.windows[w] > fleet.length) {
+            fprintf(stderr, "window %u is longer than the %u readings per trace\n", sweep.windows[w], fleet.length);
+            usage(argv[0]);
+            return 2;
+        }
+        if (verifyKernel(&fleet, sweep.windows[w]) != 0)
+            return 1;
+    }
+
+    collectThresholds(&sweep);
+    pool.fleet = &fleet;
+    pool.sweep = &sweep;
+    atomic_init(&pool.nextTile, 0);
+    pool.tileCount = (fleet.traceCount + TILE_TRACES - 1) / TILE_TRACES;
+    pool.binCount = sweep.windowCount * (sweep.thresholdCount + 1);
+    pool.bins = calloc((size_t)threadCount * pool.binCount, sizeof(struct Bin));
+    workers = calloc(threadCount, sizeof(struct Worker));
+    threads = calloc(threadCount, sizeof(pthread_t));
+    if (pool.bins == NULL || workers == NULL || threads == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    for (i = 0; i < threadCount; i++) {
+        workers[i].pool = &pool;
+        workers[i].bins = pool.bins + (size_t)i * pool.binCount;
+        if (pthread_create(&threads[i], NULL, replayWorker, &workers[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    for (i = 0; i < threadCount; i++)
+        pthread_join(threads[i], NULL);
+
+    // Fold the per-worker bins into the first row
+    for (i = 1; i < threadCount; i++) {
+        for (j = 0; j < pool.binCount; j++) {
+            struct Bin *into = &pool.bins[j], *from = &pool.bins[(size_t)i * pool.binCount + j];
+            into->windows += from->windows;
+            into->lowError += from->lowError;
+            into->mediumError += from->mediumError;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+
+    printf("# %u traces x %u readings, %u settings, %u threads, %.3f s\n",
+           fleet.traceCount, fleet.length, sweep.windowCount * sweep.lowCount * sweep.highCount, threadCount,
+           (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9);
+    // traffic_ratio is values sent per raw reading, rmse is per reported window element
+    printf("window,low,high,values,traffic_ratio,rmse,low_share,medium_share,high_share\n");
+    for (w = 0; w < sweep.windowCount; w++) {
+        for (l = 0; l < sweep.lowCount; l++) {
+            for (h = 0; h < sweep.highCount; h++) {
+                struct Outcome outcome;
+                evaluateSetting(&outcome, pool.bins + w * (sweep.thresholdCount + 1), sweep.thresholdCount + 1,
+                                sweep.windows[w], thresholdIndex(&sweep, sweep.lows[l]),
+                                thresholdIndex(&sweep, sweep.highs[h]));
+                double windowsSeen = outcome.windows[LOW_ACTIVITY] + outcome.windows[MEDIUM_ACTIVITY]
+                                   + outcome.windows[HIGH_ACTIVITY];
+                printf("%u,%.2f,%.2f,%.0f,%.4f,%.3f,%.4f,%.4f,%.4f\n",
+                       sweep.windows[w], sweep.lows[l], sweep.highs[h], outcome.values,
+                       outcome.values / outcome.rawReadings, sqrt(outcome.squaredError / outcome.windowReadings),
+                       outcome.windows[LOW_ACTIVITY] / windowsSeen, outcome.windows[MEDIUM_ACTIVITY] / windowsSeen,
+                       outcome.windows[HIGH_ACTIVITY] / windowsSeen);
+            }
+        }
+    }
+
+    free(threads);
+    free(workers);
+    free(pool.bins);
+    free(fleet.samples);
+    return 0;
+}